@@ -95,7 +95,7 @@ class Array {
             delete[] data;
         }
         
-        void save_to_png(char* output_name) {
+        void save_to_png(const char* output_name) {
             const int output_name_length = strlen(output_name);
             ASSERT(sizes.size() == 2 || (sizes.size() == 3 && channels()==3), "Need array either to be 3D with 3 channels in the third dimension or to be 2D to save to png");
             ASSERT(!strcmp(&output_name[output_name_length-4],".png"), "output_name must have the .png extension");
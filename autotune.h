@@ -0,0 +1,217 @@
+
+/*
+
+This is a parameter autotuner for PatchMatch. It times PatchMatch on a sample pair of images over a range of parameter values and writes a profile with the fastest parameters that reach a target mean patch distance in every run. See patchmatch.h for the PatchMatch implementation itself. 
+
+*/
+
+#pragma once
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include "util.h"
+#include "array.h"
+#include "patchmatch.h"
+#include "sharded.h"
+
+#define AUTOTUNE_MAX_NUM_ITERATIONS 8
+#define AUTOTUNE_NUM_RUNS 3
+
+struct autotune_result {
+    int num_iterations;
+    int random_search_size_exponent;
+    int num_random_search_attempts;
+    int candidate_cache_size;
+    int num_shards;
+    double mean_patch_distance;
+    double run_time;
+};
+
+double seconds_since(const std::chrono::high_resolution_clock::time_point &start_time) {
+    std::chrono::high_resolution_clock::time_point end_time = std::chrono::high_resolution_clock::now();
+    return (std::chrono::duration_cast<std::chrono::nanoseconds>(end_time-start_time).count()) / (pow(10.0,9.0));
+}
+
+void time_autotune_run(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            const autotune_result &parameters, 
+            double &mean_patch_distance, 
+            double &run_time
+        ) {
+    // One run exactly as main does it: a random nearest neighbor field followed by a single call solving all iterations
+    Array<int> Ann(vector<int>{Ann_height, Ann_width, NNF_CHANNELS});
+    long total_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped;
+    std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+    randomize_nnf(A, B_library, Ann, Ann_height, Ann_width, patch_dim);
+    if (parameters.num_shards > 1) {
+        patchmatch_sharded(A, B_library, Ann, A_height, A_width, Ann_height, Ann_width, patch_dim, parameters.num_shards, parameters.num_iterations, parameters.random_search_size_exponent, parameters.num_random_search_attempts, parameters.candidate_cache_size, total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+    } else {
+        patchmatch(A, B_library, Ann, A_height, A_width, Ann_height, Ann_width, patch_dim, parameters.num_iterations, parameters.random_search_size_exponent, parameters.num_random_search_attempts, parameters.candidate_cache_size, total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+    }
+    run_time = seconds_since(start_time);
+}
+
+void time_autotune_candidate(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            autotune_result &result
+        ) {
+    // The candidate is run AUTOTUNE_NUM_RUNS times with seeds 1 to AUTOTUNE_NUM_RUNS, so every candidate sees the same random streams. 
+    // It is judged by its worst run: the highest mean patch distance and the longest run time. 
+    result.mean_patch_distance = 0;
+    result.run_time = 0;
+    for(int run_index=0; run_index<AUTOTUNE_NUM_RUNS; run_index++) {
+        double mean_patch_distance, run_time;
+        std::srand(run_index+1);
+        time_autotune_run(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, result, mean_patch_distance, run_time);
+        result.mean_patch_distance = MAX(result.mean_patch_distance, mean_patch_distance);
+        result.run_time = MAX(result.run_time, run_time);
+    }
+    cout << "Iterations: " << result.num_iterations << ", Size Exponent: " << result.random_search_size_exponent << ", Attempts: " << result.num_random_search_attempts << ", Cache Size: " << result.candidate_cache_size << ", Shards: " << result.num_shards << ", Worst Mean Patch Distance: " << result.mean_patch_distance << ", Worst Run Time: " << result.run_time << " seconds." << endl;
+    fflush(stdout);
+}
+
+bool autotune_result_faster(const autotune_result &a, const autotune_result &b) {
+    return a.run_time < b.run_time;
+}
+
+void autotune(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            const double &requested_target_mean_patch_distance, 
+            autotune_result &best_result
+        ) {
+    // Stage 1 sweeps the search parameters in a single process. For each combination, num_iterations is increased until the worst run reaches the target, or until it is no faster than the fastest setting found so far, since more iterations only take longer. 
+    // Stage 2 tries more worker processes (see sharded.h) for the fastest setting from stage 1. 
+    // Finally, the fastest setting is checked with one more run with a fresh seed. If that run misses the target, the next fastest setting is checked instead. 
+    // If requested_target_mean_patch_distance is negative, the target is the worst mean patch distance reached with the default parameters (4 iterations, size exponent 3, 8 attempts, cache size 0). 
+    static const int random_search_size_exponents[] = {2, 3, 4, 5};
+    static const int nums_random_search_attempts[] = {2, 4, 8, 16};
+    static const int candidate_cache_sizes[] = {0, 8};
+    
+    double target_mean_patch_distance = requested_target_mean_patch_distance;
+    if (target_mean_patch_distance < 0) {
+        autotune_result default_result;
+        default_result.num_iterations = 4;
+        default_result.random_search_size_exponent = 3;
+        default_result.num_random_search_attempts = 8;
+        default_result.candidate_cache_size = 0;
+        default_result.num_shards = 1;
+        time_autotune_candidate(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, default_result);
+        target_mean_patch_distance = default_result.mean_patch_distance;
+    }
+    NEWLINE;
+    TEST(target_mean_patch_distance);
+    NEWLINE;
+    
+    // Every result reaching the target, and the result with the lowest mean patch distance in case none do
+    vector<autotune_result> results;
+    autotune_result lowest_result;
+    lowest_result.mean_patch_distance = -1;
+    for(int exponent_index=0; exponent_index<sizeof(random_search_size_exponents)/sizeof(int); exponent_index++) {
+        for(int attempts_index=0; attempts_index<sizeof(nums_random_search_attempts)/sizeof(int); attempts_index++) {
+            for(int cache_size_index=0; cache_size_index<sizeof(candidate_cache_sizes)/sizeof(int); cache_size_index++) {
+                autotune_result result;
+                result.random_search_size_exponent = random_search_size_exponents[exponent_index];
+                result.num_random_search_attempts = nums_random_search_attempts[attempts_index];
+                result.candidate_cache_size = candidate_cache_sizes[cache_size_index];
+                result.num_shards = 1;
+                for(result.num_iterations=1; result.num_iterations<=AUTOTUNE_MAX_NUM_ITERATIONS; result.num_iterations++) {
+                    time_autotune_candidate(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, result);
+                    if (lowest_result.mean_patch_distance < 0 || result.mean_patch_distance < lowest_result.mean_patch_distance) {
+                        lowest_result = result;
+                    }
+                    if (result.mean_patch_distance <= target_mean_patch_distance) {
+                        results.push_back(result);
+                        break;
+                    }
+                    if (results.size() > 0 && result.run_time >= min_element(results.begin(), results.end(), autotune_result_faster)->run_time) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    if (results.size() > 0) {
+        const int num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+        autotune_result fastest_result = *min_element(results.begin(), results.end(), autotune_result_faster);
+        for(int num_shards=2; num_shards<=MIN(num_processors,Ann_height); num_shards*=2) {
+            autotune_result result = fastest_result;
+            result.num_shards = num_shards;
+            time_autotune_candidate(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, result);
+            if (result.mean_patch_distance <= target_mean_patch_distance) {
+                results.push_back(result);
+            }
+        }
+    }
+    
+    sort(results.begin(), results.end(), autotune_result_faster);
+    std::srand( std::time(NULL) );
+    for(int i=0; i<results.size(); i++) {
+        double mean_patch_distance, run_time;
+        time_autotune_run(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, results[i], mean_patch_distance, run_time);
+        NEWLINE;
+        cout << "Check Run: Iterations: " << results[i].num_iterations << ", Size Exponent: " << results[i].random_search_size_exponent << ", Attempts: " << results[i].num_random_search_attempts << ", Cache Size: " << results[i].candidate_cache_size << ", Shards: " << results[i].num_shards << ", Mean Patch Distance: " << mean_patch_distance << ", Run Time: " << run_time << " seconds." << endl;
+        fflush(stdout);
+        if (mean_patch_distance <= target_mean_patch_distance) {
+            best_result = results[i];
+            return;
+        }
+    }
+    fprintf(stderr, "No parameters reliably reached the target mean patch distance of %f. Using the parameters with the lowest mean patch distance instead.\n", target_mean_patch_distance);
+    best_result = lowest_result;
+}
+
+void write_autotune_profile(const char* profile_name, const autotune_result &result, const char* A_name, const char* B_name) {
+    string profile = string("# PatchMatch profile written by main -autotune on ")+A_name+" and "+B_name+"\n";
+    profile += "# worst of "+to_string(AUTOTUNE_NUM_RUNS)+" runs: mean_patch_distance: "+to_string(result.mean_patch_distance)+", run time: "+to_string(result.run_time)+" seconds\n";
+    profile += "-num_iterations "+to_string(result.num_iterations)+"\n";
+    profile += "-random_search_size_exponent "+to_string(result.random_search_size_exponent)+"\n";
+    profile += "-random_search_attempts "+to_string(result.num_random_search_attempts)+"\n";
+    profile += "-candidate_cache_size "+to_string(result.candidate_cache_size)+"\n";
+    if (result.num_shards > 1) {
+        profile += "-num_shards "+to_string(result.num_shards)+"\n";
+    }
+    write_file(profile_name, profile);
+}
+
+void read_profile(const char* profile_name, vector<string> &profile_tokens) {
+    // A profile holds command line options, e.g. "-num_iterations 3", one per line. Lines starting with # are comments. 
+    string profile;
+    vector<string> lines;
+    read_file_or_exit(profile_name, profile);
+    split(profile, "\n", lines, true);
+    for(int line_index=0; line_index<lines.size(); line_index++) {
+        if (lines[line_index].size() == 0 || lines[line_index][0] == '#') {
+            continue;
+        }
+        split(lines[line_index], " ", profile_tokens, true);
+    }
+    if (profile_tokens.size() == 0) {
+        fprintf(stderr, "%s does not contain any options\n", profile_name);
+        exit(1);
+    }
+}
+
+#endif // AUTOTUNE_H
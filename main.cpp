@@ -7,7 +7,10 @@ This is our main executable that wraps our PatchMatch implementation. See patchm
 
 #include <chrono>
 #include <cmath>
+#include <climits>
 #include "patchmatch.h"
+#include "sharded.h"
+#include "autotune.h"
 #include "array.h"
 #include "pfm.h"
 
@@ -44,10 +47,151 @@ void usage() {
                     "\n"
                     "    -random_search_attempts <random_search_attempts>: This int value defines how many neighbors we will compare to in each iteration of the random search. The default value is 8. \n"
                     "\n"
+                    "    -candidate_cache_size <candidate_cache_size>: This int value determines how many of the most recently tested candidate matches are remembered for each patch in A. Candidates identical to the current match or to a remembered candidate are skipped without computing their patch distance. Candidates are remembered by a 16 bit fingerprint, so in rare cases an untested candidate is skipped too. Must be in the range [0,255]; 0 only skips candidates identical to the current match. The cache takes 2*<candidate_cache_size>+1 bytes per patch and skips more evaluations in later iterations, but the lookups cost about as much as they save at small sizes. The default value is 0. \n"
+                    "\n"
+                    "    -bidirectional <output_file_b_to_a>.pfm: If specified, the nearest neighbor field from input image B to input image A is also computed and written to <output_file_b_to_a>.pfm, in the same format as <output_file>.pfm with the roles of A and B swapped. Both fields are solved concurrently in the same process, and each is seeded from the inverse of the other. \n"
+                    "\n"
+                    "    -reconstruction <reconstruction_output>.png: If specified, an image with the same dimensions as input image A is reconstructed from the nearest neighbor field and written to <reconstruction_output>.png. Each pixel is the average of the corresponding pixels of the matched B patches of all patches in A that cover it. \n"
+                    "\n"
+                    "    -reconstruction_weighting <uniform|distance>: This determines how the matched B patches are weighted when averaged in the reconstruction. With \"uniform\", all patches are weighted equally. With \"distance\", a patch with patch distance d is weighted by exp(-d/(2*m)), where m is the final mean patch distance. The default value is uniform. \n"
+                    "\n"
+                    "    -queries <queries_file>: If specified, the nearest neighbor field is only computed for the patches in A listed in <queries_file>, which has one query per line given as the x and y coordinates of the upper left corner of the patch separated by a space. PatchMatch is run once on the union of small windows of patches around the queries, so nearby queries share propagation and the run time scales with the number of queries rather than with the size of A. <output_file>.pfm will then have a height of 1 and a width equal to the number of queries, and output_file[0,i,:] holds the result for the i-th query. -bidirectional and -reconstruction are ignored in this mode. \n"
+                    "\n"
+                    "    -query_window_radius <query_window_radius>: This int value determines the size of the window of patches around each query used when -queries is specified. The window spans <query_window_radius> patches in each direction from the query. The default value is 8. \n"
+                    "\n"
+                    "    -query_random_init_attempts <query_random_init_attempts>: This int value determines how many random matches are tried for each patch in the query windows when -queries is specified, keeping the best one as its initial match. The default value is 16. \n"
+                    "\n"
+                    "    -library <library_file>: If specified, patches are matched against a library of B images made of input image B followed by the .png files listed in <library_file>, one file name per line. Each patch in A is matched to the closest patch in any image of the library: the first iteration is run against each image on its own and the results merged, and the remaining iterations search the whole library. The index of the matched image (0 for input image B, i for the i-th file listed) is written to <output_file>_library_index.pfm, a single channel .pfm file with the same dimensions as <output_file>.pfm. Cannot be used with -bidirectional. \n"
+                    "\n"
+                    "    -num_shards <num_shards>: This int value determines how many worker processes solve the nearest neighbor field. If greater than 1, the field is split into <num_shards> horizontal stripes, each solved by its own worker process forked from main, and the rows at the borders of the stripes are exchanged between neighboring workers after every iteration so that good matches propagate across stripes. Only supported on Linux. Ignored with -queries and cannot be used with -bidirectional, except that a value from -profile is then replaced by 1. The default value is 1. \n"
+                    "\n"
+                    "    -autotune <profile_file>: If specified, no nearest neighbor field is written. Instead, input images A and B (and the -library images, if any) are used as a sample to time PatchMatch over a range of values of -num_iterations, -random_search_size_exponent, -random_search_attempts, -candidate_cache_size and -num_shards. Each setting is run as a normal run would be, several times with different seeds, and the fastest values reaching the target mean patch distance in every run (and in one more check run) are written to <profile_file>. <output_file> is ignored in this mode. \n"
+                    "\n"
+                    "    -target_mean_patch_distance <target_mean_patch_distance>: This float value is the mean patch distance that -autotune must reach. By default, it is the worst mean patch distance reached on the sample with the default values of the options above. \n"
+                    "\n"
+                    "    -profile <profile_file>: If specified, the options in <profile_file> (e.g. as written by -autotune) are used as the default values of those options. Options given on the command line take precedence over the profile. \n"
+                    "\n"
            );
     exit(1);
 }
 
+void write_nnf_to_pfm_file(const char* output_name, const Array<int> &Ann, const int &Ann_height, const int &Ann_width) {
+    float *depth = new float[Ann_height*Ann_width*3];
+    for (int y = 0; y < Ann_height; y++) {
+        for (int x = 0; x < Ann_width; x++) {
+            int i = (Ann_height-1-y)*Ann_width*3+x*3;
+            
+            depth[i] = FLOAT(Ann(y,x,X_COORD));
+            depth[i+1] = FLOAT(Ann(y,x,Y_COORD));
+            depth[i+2] = FLOAT(Ann(y,x,D_COORD));
+        }
+    }
+    write_pfm_file3(output_name, depth, Ann_width, Ann_height);
+    delete[] depth;
+}
+
+void write_library_index_to_pfm_file(const char* output_name, const Array<int> &Ann, const int &Ann_height, const int &Ann_width) {
+    // <output_file>.pfm becomes <output_file>_library_index.pfm
+    string index_output_name(output_name);
+    if (index_output_name.size() >= 4 && index_output_name.substr(index_output_name.size()-4) == ".pfm") {
+        index_output_name = index_output_name.substr(0, index_output_name.size()-4);
+    }
+    index_output_name += "_library_index.pfm";
+    
+    float *depth = new float[Ann_height*Ann_width];
+    for (int y = 0; y < Ann_height; y++) {
+        for (int x = 0; x < Ann_width; x++) {
+            depth[(Ann_height-1-y)*Ann_width+x] = FLOAT(Ann(y,x,I_COORD));
+        }
+    }
+    write_pfm_file1(index_output_name.c_str(), depth, Ann_width, Ann_height);
+    delete[] depth;
+}
+
+void read_library(const char* library_name, vector<string> &B_library_names) {
+    string library_file_contents;
+    vector<string> lines;
+    read_file_or_exit(library_name, library_file_contents);
+    split(library_file_contents, "\n", lines, true);
+    for(int line_index=0; line_index<lines.size(); line_index++) {
+        if (lines[line_index].size() > 0) {
+            B_library_names.push_back(lines[line_index]);
+        }
+    }
+    if (B_library_names.size() == 0) {
+        fprintf(stderr, "%s does not list any library images\n", library_name);
+        exit(1);
+    }
+}
+
+void print_final_patch_distances(const long &total_patch_distance, const double &mean_patch_distance, const long &num_patch_SSD_evaluations, const long &num_patch_SSD_evaluations_skipped) {
+    NEWLINE;
+    cout << "Final Total Patch Distance: " << total_patch_distance << endl;
+    cout << "Final Mean Patch Distance:  " << mean_patch_distance << endl;
+    
+    NEWLINE;
+    cout << "Patch Distance Evaluations:         " << num_patch_SSD_evaluations << endl;
+    cout << "Patch Distance Evaluations Skipped: " << num_patch_SSD_evaluations_skipped << endl;
+}
+
+void print_total_run_time(const std::chrono::high_resolution_clock::time_point &start_time) {
+    std::chrono::high_resolution_clock::time_point end_time = std::chrono::high_resolution_clock::now();
+    
+    NEWLINE;
+    cout << "Total Run Time: " << (std::chrono::duration_cast<std::chrono::nanoseconds>(end_time-start_time).count()) / (pow(10.0,9.0)) << " seconds." << endl;
+    NEWLINE;
+}
+
+bool parse_int(const string &token, int &value) {
+    // Unlike atoi(), rejects empty tokens and tokens with anything after the number
+    char* end;
+    const long parsed_value = strtol(token.c_str(), &end, 10);
+    if (token.size() == 0 || *end != '\0' || parsed_value < INT_MIN || parsed_value > INT_MAX) {
+        return false;
+    }
+    value = INT(parsed_value);
+    return true;
+}
+
+void read_queries(const char* queries_name, Array<int> &queries, const int &Ann_height, const int &Ann_width) {
+    string queries_file_contents;
+    vector<string> lines;
+    read_file_or_exit(queries_name, queries_file_contents);
+    split(queries_file_contents, "\n", lines);
+    
+    vector<int> query_coords;
+    for(int line_index=0; line_index<lines.size(); line_index++) {
+        vector<string> tokens;
+        split(lines[line_index], " ", tokens, true);
+        if (tokens.size() == 0) {
+            continue;
+        }
+        int x, y;
+        if (tokens.size() != 2 || !parse_int(tokens[0], x) || !parse_int(tokens[1], y)) {
+            fprintf(stderr, "Line %d of %s is not a query. Each line must hold the integer x and y coordinates of a query patch separated by a space.\n", line_index+1, queries_name);
+            exit(1);
+        }
+        if (x < 0 || x >= Ann_width || y < 0 || y >= Ann_height) {
+            fprintf(stderr, "Query (%d,%d) on line %d of %s is out of range. Queries must satisfy 0<=x<%d and 0<=y<%d.\n", x, y, line_index+1, queries_name, Ann_width, Ann_height);
+            exit(1);
+        }
+        query_coords.push_back(y);
+        query_coords.push_back(x);
+    }
+    
+    if (query_coords.size() == 0) {
+        fprintf(stderr, "%s does not contain any queries\n", queries_name);
+        exit(1);
+    }
+    
+    const int num_queries = query_coords.size()/2;
+    queries.resize(vector<int>{num_queries, 2});
+    for(int query_index=0; query_index<num_queries; query_index++) {
+        queries(query_index,Y_COORD) = query_coords[2*query_index];
+        queries(query_index,X_COORD) = query_coords[2*query_index+1];
+    }
+}
+
 int main(int argc, char* argv[]) {
     
     std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
@@ -61,10 +205,41 @@ int main(int argc, char* argv[]) {
     static const char* A_name = argv[1];
     static const char* B_name = argv[2];
     static const char* output_name = argv[3];
-    static const int patch_dim = atoi(get_command_line_param_val_default_val(argc, argv, "-patch_dim", "5"));
-    static const int num_iterations = atoi(get_command_line_param_val_default_val(argc, argv, "-num_iterations", "4"));
-    static const int random_search_size_exponent = atoi(get_command_line_param_val_default_val(argc, argv, "-random_search_size_exponent", "3"));
-    static const int num_random_search_attempts = atoi(get_command_line_param_val_default_val(argc, argv, "-random_search_attempts", "8"));
+    
+    // Options from a profile (see autotune.h) are appended after the actual command line options so that options given on the command line take precedence
+    static const char* profile_name = get_command_line_param_val_default_val(argc, argv, "-profile", "");
+    vector<string> profile_tokens;
+    if (strlen(profile_name) > 0) {
+        read_profile(profile_name, profile_tokens);
+    }
+    vector<char*> args(argv, argv+argc);
+    for(int i=0; i<profile_tokens.size(); i++) {
+        args.push_back(const_cast<char*>(profile_tokens[i].c_str()));
+    }
+    int num_args = args.size();
+    char** arg_values = args.data();
+    
+    static const int patch_dim = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-patch_dim", "5"));
+    static const int num_iterations = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-num_iterations", "4"));
+    static const int random_search_size_exponent = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-random_search_size_exponent", "3"));
+    static const int num_random_search_attempts = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-random_search_attempts", "8"));
+    static const int candidate_cache_size = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-candidate_cache_size", "0"));
+    static const char* bidirectional_output_name = get_command_line_param_val_default_val(num_args, arg_values, "-bidirectional", "");
+    static const bool bidirectional = strlen(bidirectional_output_name) > 0;
+    static const char* reconstruction_output_name = get_command_line_param_val_default_val(num_args, arg_values, "-reconstruction", "");
+    static const bool reconstruct = strlen(reconstruction_output_name) > 0;
+    static const bool reconstruction_distance_weighted = CHAR_STAR_EQUAL(get_command_line_param_val_default_val(num_args, arg_values, "-reconstruction_weighting", "uniform"), "distance");
+    static const char* queries_name = get_command_line_param_val_default_val(num_args, arg_values, "-queries", "");
+    static const bool sparse = strlen(queries_name) > 0;
+    static const int query_window_radius = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-query_window_radius", "8"));
+    static const int query_random_init_attempts = atoi(get_command_line_param_val_default_val(num_args, arg_values, "-query_random_init_attempts", "16"));
+    static const char* library_name = get_command_line_param_val_default_val(num_args, arg_values, "-library", "");
+    // A shard count that only comes from the profile is a default like any other, so bidirectional mode, which cannot be sharded, overrides it rather than stopping
+    static const bool num_shards_on_command_line = strlen(get_command_line_param_val_default_val(argc, argv, "-num_shards", "")) > 0;
+    static const int num_shards = (bidirectional && !num_shards_on_command_line) ? 1 : atoi(get_command_line_param_val_default_val(num_args, arg_values, "-num_shards", "1"));
+    static const char* autotune_profile_name = get_command_line_param_val_default_val(num_args, arg_values, "-autotune", "");
+    static const bool autotune_mode = strlen(autotune_profile_name) > 0;
+    static const double target_mean_patch_distance = atof(get_command_line_param_val_default_val(num_args, arg_values, "-target_mean_patch_distance", "-1"));
     
     static const png::image< png::rgba_pixel > A_image(A_name); 
     static const png::image< png::rgba_pixel > B_image(B_name); 
@@ -74,9 +249,43 @@ int main(int argc, char* argv[]) {
     static const int B_width = B_image.get_width();
     static const int Ann_height = A_height-patch_dim+1;
     static const int Ann_width = A_width-patch_dim+1;
+    static const int Bnn_height = B_height-patch_dim+1;
+    static const int Bnn_width = B_width-patch_dim+1;
     static const Array<byte> A(A_image);
     static const Array<byte> B(B_image);
-    Array<int> Ann(vector<int>{Ann_height, Ann_width, 3});
+    
+    // The B library holds input image B followed by any images listed in the library file. Each image is decoded once and shared read-only by every solve. 
+    vector<string> B_library_names;
+    if (strlen(library_name) > 0) {
+        read_library(library_name, B_library_names);
+    }
+    static const int B_library_size = 1+B_library_names.size();
+    vector< Array<byte> > B_library_images(B_library_size-1);
+    #pragma omp parallel for
+    for(int bi=1; bi<B_library_size; bi++) {
+        B_library_images[bi-1].assign(Array<byte>(png::image< png::rgba_pixel >(B_library_names[bi-1])));
+    }
+    vector<const Array<byte>*> B_library(1, &B);
+    for(int bi=1; bi<B_library_size; bi++) {
+        B_library.push_back(&B_library_images[bi-1]);
+    }
+    const vector<const Array<byte>*> A_library(1, &A);
+    if (B_library_size > 1 && bidirectional) {
+        fprintf(stderr, "-bidirectional cannot be used with -library.\n");
+        exit(1);
+    }
+    if (num_shards > 1 && bidirectional) {
+        fprintf(stderr, "-bidirectional cannot be used with -num_shards.\n");
+        exit(1);
+    }
+    if (candidate_cache_size < 0 || candidate_cache_size > 255) {
+        fprintf(stderr, "-candidate_cache_size must be in the range [0,255].\n");
+        exit(1);
+    }
+    if (num_shards < 1 || num_shards > Ann_height) {
+        fprintf(stderr, "-num_shards must be in the range [1,%d].\n", Ann_height);
+        exit(1);
+    }
     
     NEWLINE;
     PRINT("Parameter Values");
@@ -90,57 +299,159 @@ int main(int argc, char* argv[]) {
     TEST(num_iterations);
     TEST(random_search_size_exponent);
     TEST(num_random_search_attempts);
+    TEST(candidate_cache_size);
+    TEST(bidirectional);
+    TEST(reconstruct);
+    TEST(reconstruction_distance_weighted);
+    TEST(sparse);
+    TEST(query_window_radius);
+    TEST(query_random_init_attempts);
+    TEST(B_library_size);
+    TEST(num_shards);
+    TEST(autotune_mode);
     
     long total_patch_distance;
     double mean_patch_distance;
+    long num_patch_SSD_evaluations;
+    long num_patch_SSD_evaluations_skipped;
     
-    // Randomize the nearest neighbor field 
-    long initial_total_patch_distance = 0;
-    #pragma omp parallel for 
-    for(int y=0;y<Ann_height;y++) { 
-        for(int x=0;x<Ann_width;x++) { 
-                Ann(y,x,Y_COORD)=RAND_INT(0, B_height-patch_dim); 
-                Ann(y,x,X_COORD)=RAND_INT(0, B_width-patch_dim); 
-                Ann(y,x,D_COORD)=patch_SSD(A, B, x, y, Ann(y,x,X_COORD), Ann(y,x,Y_COORD), patch_dim); 
-        } 
-    } 
-    
-    #pragma omp parallel for reduction(+:initial_total_patch_distance)
-    for (int yy = 0; yy < Ann_height; ++yy) {
-        for (int xx = 0; xx < Ann_width; ++xx) {
-            initial_total_patch_distance += Ann(yy,xx,D_COORD);
+    if (autotune_mode) {
+        autotune_result best_result;
+        NEWLINE;
+        autotune(A, B_library, A_height, A_width, Ann_height, Ann_width, patch_dim, target_mean_patch_distance, best_result);
+        write_autotune_profile(autotune_profile_name, best_result, A_name, B_name);
+        
+        NEWLINE;
+        PRINT("Autotuned Parameter Values");
+        TEST(best_result.num_iterations);
+        TEST(best_result.random_search_size_exponent);
+        TEST(best_result.num_random_search_attempts);
+        TEST(best_result.candidate_cache_size);
+        TEST(best_result.num_shards);
+        TEST(best_result.mean_patch_distance);
+        TEST(best_result.run_time);
+        
+        print_total_run_time(start_time);
+        
+        return 0;
+    }
+    
+    if (sparse) {
+        Array<int> queries;
+        read_queries(queries_name, queries, Ann_height, Ann_width);
+        const int num_queries = queries.height();
+        Array<int> Qnn;
+        
+        NEWLINE;
+        TEST(num_queries);
+        
+        patchmatch_sparse(A, B_library, queries, Qnn, num_queries, A_height, A_width, patch_dim, query_window_radius, query_random_init_attempts, num_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+        
+        // Each query is written as one pixel of a 1 pixel tall .pfm file in the order the queries were given
+        Array<int> Qnn_as_nnf(vector<int>{1, num_queries, NNF_CHANNELS});
+        for(int query_index=0; query_index<num_queries; query_index++) {
+            for(int coord=0; coord<NNF_CHANNELS; coord++) {
+                Qnn_as_nnf(0,query_index,coord) = Qnn(query_index,coord);
+            }
+        }
+        write_nnf_to_pfm_file(output_name, Qnn_as_nnf, 1, num_queries);
+        if (B_library_size > 1) {
+            write_library_index_to_pfm_file(output_name, Qnn_as_nnf, 1, num_queries);
         }
+        
+        print_final_patch_distances(total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+        print_total_run_time(start_time);
+        
+        return 0;
     }
+    
+    Array<int> Ann(vector<int>{Ann_height, Ann_width, NNF_CHANNELS});
+    
+    // Randomize the nearest neighbor field 
+    long initial_total_patch_distance;
+    double initial_mean_patch_distance;
+    randomize_nnf(A, B_library, Ann, Ann_height, Ann_width, patch_dim);
+    calculate_patch_distance_totals(Ann, Ann_height, Ann_width, initial_total_patch_distance, initial_mean_patch_distance);
     NEWLINE;
     cout << "Initial Total Patch Distance: " << initial_total_patch_distance << endl;
-    cout << "Initial Mean Patch Distance:  " << DOUBLE(initial_total_patch_distance)/DOUBLE(Ann_height*Ann_width) << endl;
+    cout << "Initial Mean Patch Distance:  " << initial_mean_patch_distance << endl;
     fflush(stdout);
     
-    patchmatch(A, B, Ann, A_height, A_width, B_height, B_width, Ann_height, Ann_width, patch_dim, num_iterations, random_search_size_exponent, num_random_search_attempts, total_patch_distance, mean_patch_distance);
-    
-    // Write output to .pfm file
-    
-    float *depth = new float[Ann_height*Ann_width*3];
-    for (int y = 0; y < Ann_height; y++) {
-        for (int x = 0; x < Ann_width; x++) {
-            int i = (Ann_height-1-y)*Ann_width*3+x*3;
+    if (num_shards > 1) {
+        patchmatch_sharded(A, B_library, Ann, A_height, A_width, Ann_height, Ann_width, patch_dim, num_shards, num_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+    } else if (!bidirectional) {
+        patchmatch(A, B_library, Ann, A_height, A_width, Ann_height, Ann_width, patch_dim, num_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+    } else {
+        Array<int> Bnn(vector<int>{Bnn_height, Bnn_width, NNF_CHANNELS});
+        long Bnn_total_patch_distance;
+        double Bnn_mean_patch_distance;
+        long Bnn_num_patch_SSD_evaluations;
+        long Bnn_num_patch_SSD_evaluations_skipped;
+        
+        randomize_nnf(B, A_library, Bnn, Bnn_height, Bnn_width, patch_dim);
+        seed_nnf_from_inverse(Bnn, Ann, Ann_height, Ann_width);
+        calculate_patch_distance_totals(Bnn, Bnn_height, Bnn_width, initial_total_patch_distance, initial_mean_patch_distance);
+        cout << "Initial Total Patch Distance (B to A): " << initial_total_patch_distance << endl;
+        cout << "Initial Mean Patch Distance (B to A):  " << initial_mean_patch_distance << endl;
+        fflush(stdout);
+        
+        // The iterations are split into two passes. Both directions are solved concurrently in each pass, and after each pass each field is seeded from the inverse of the other. 
+        num_patch_SSD_evaluations = 0;
+        num_patch_SSD_evaluations_skipped = 0;
+        Bnn_num_patch_SSD_evaluations = 0;
+        Bnn_num_patch_SSD_evaluations_skipped = 0;
+        const int num_iterations_per_pass[2] = { (num_iterations+1)/2, num_iterations/2 };
+        candidate_cache Ann_tested_candidates, Bnn_tested_candidates;
+        init_candidate_cache(Ann_tested_candidates, Ann_height, Ann_width, candidate_cache_size);
+        init_candidate_cache(Bnn_tested_candidates, Bnn_height, Bnn_width, candidate_cache_size);
+        for(int pass=0; pass<2; pass++) {
+            if (num_iterations_per_pass[pass] == 0) {
+                continue;
+            }
+            // Keep the scan direction alternating across passes, e.g. 5 iterations are scanned D,U,D | U,D rather than D,U,D | D,U
+            const bool pass_starts_going_down_and_right = (pass == 0) || IS_EVEN(num_iterations_per_pass[0]);
+            long pass_num_patch_SSD_evaluations, pass_num_patch_SSD_evaluations_skipped;
+            long Bnn_pass_num_patch_SSD_evaluations, Bnn_pass_num_patch_SSD_evaluations_skipped;
+            #pragma omp parallel sections num_threads(2)
+            {
+                #pragma omp section
+                patchmatch(A, B_library, Ann, A_height, A_width, Ann_height, Ann_width, patch_dim, num_iterations_per_pass[pass], random_search_size_exponent, num_random_search_attempts, candidate_cache_size, total_patch_distance, mean_patch_distance, pass_num_patch_SSD_evaluations, pass_num_patch_SSD_evaluations_skipped, pass_starts_going_down_and_right, NULL, -1, 1, &Ann_tested_candidates);
+                #pragma omp section
+                patchmatch(B, A_library, Bnn, B_height, B_width, Bnn_height, Bnn_width, patch_dim, num_iterations_per_pass[pass], random_search_size_exponent, num_random_search_attempts, candidate_cache_size, Bnn_total_patch_distance, Bnn_mean_patch_distance, Bnn_pass_num_patch_SSD_evaluations, Bnn_pass_num_patch_SSD_evaluations_skipped, pass_starts_going_down_and_right, NULL, -1, 1, &Bnn_tested_candidates);
+            }
+            num_patch_SSD_evaluations += pass_num_patch_SSD_evaluations;
+            num_patch_SSD_evaluations_skipped += pass_num_patch_SSD_evaluations_skipped;
+            Bnn_num_patch_SSD_evaluations += Bnn_pass_num_patch_SSD_evaluations;
+            Bnn_num_patch_SSD_evaluations_skipped += Bnn_pass_num_patch_SSD_evaluations_skipped;
             
-            depth[i] = FLOAT(Ann(y,x,X_COORD));
-            depth[i+1] = FLOAT(Ann(y,x,Y_COORD));
-            depth[i+2] = FLOAT(Ann(y,x,D_COORD));
+            seed_nnf_from_inverse(Ann, Bnn, Bnn_height, Bnn_width);
+            seed_nnf_from_inverse(Bnn, Ann, Ann_height, Ann_width);
         }
+        calculate_patch_distance_totals(Ann, Ann_height, Ann_width, total_patch_distance, mean_patch_distance);
+        calculate_patch_distance_totals(Bnn, Bnn_height, Bnn_width, Bnn_total_patch_distance, Bnn_mean_patch_distance);
+        
+        write_nnf_to_pfm_file(bidirectional_output_name, Bnn, Bnn_height, Bnn_width);
+        
+        NEWLINE;
+        cout << "Final Total Patch Distance (B to A): " << Bnn_total_patch_distance << endl;
+        cout << "Final Mean Patch Distance (B to A):  " << Bnn_mean_patch_distance << endl;
+        cout << "Patch Distance Evaluations (B to A):         " << Bnn_num_patch_SSD_evaluations << endl;
+        cout << "Patch Distance Evaluations Skipped (B to A): " << Bnn_num_patch_SSD_evaluations_skipped << endl;
     }
-    write_pfm_file3(output_name, depth, Ann_width, Ann_height);
     
-    NEWLINE;
-    cout << "Final Total Patch Distance: " << total_patch_distance << endl;
-    cout << "Final Mean Patch Distance:  " << DOUBLE(total_patch_distance)/DOUBLE(Ann_height*Ann_width) << endl;
+    write_nnf_to_pfm_file(output_name, Ann, Ann_height, Ann_width);
+    if (B_library_size > 1) {
+        write_library_index_to_pfm_file(output_name, Ann, Ann_height, Ann_width);
+    }
     
-    std::chrono::high_resolution_clock::time_point end_time = std::chrono::high_resolution_clock::now();
+    if (reconstruct) {
+        Array<byte> reconstruction;
+        reconstruct_from_nnf(B_library, Ann, reconstruction, A_height, A_width, Ann_height, Ann_width, patch_dim, reconstruction_distance_weighted, mean_patch_distance);
+        reconstruction.save_to_png(reconstruction_output_name);
+    }
     
-    NEWLINE;
-    cout << "Total Run Time: " << (std::chrono::duration_cast<std::chrono::nanoseconds>(end_time-start_time).count()) / (pow(10.0,9.0)) << " seconds." << endl;
-    NEWLINE;
+    print_final_patch_distances(total_patch_distance, mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped);
+    print_total_run_time(start_time);
     
     return 0;
 }
@@ -16,6 +16,13 @@ This is an implementation of PatchMatch. Please see http://gfx.cs.princeton.edu/
 #define Y_COORD 0
 #define X_COORD 1
 #define D_COORD 2
+#define I_COORD 3 // Index of the image in the B library
+#define NNF_CHANNELS 4
+
+#define ACTIVE_PATCH 1
+#define FIXED_PATCH 2 // Patches marked FIXED_PATCH in an active mask are not searched, but their matches are propagated to their neighbors
+#define IS_ACTIVE(active_mask,y,x) ((active_mask) == NULL || (*(active_mask))(y,x)) // Patches outside an active mask are neither initialized nor searched
+#define IS_SEARCHED(active_mask,y,x) ((active_mask) == NULL || (*(active_mask))(y,x) == ACTIVE_PATCH)
 
 int patch_SSD(
             const Array<byte> &A, 
@@ -38,27 +45,209 @@ int patch_SSD(
     return score;
 }
 
+void randomize_nnf(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            Array<int> &Ann, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            const Array<byte> *active_mask=NULL, 
+            const int &num_random_init_attempts=1
+        ) {
+    // Each patch is matched to the best of num_random_init_attempts random patches in each image of the B library, so that every image is seeded as densely as it would be on its own
+    const int B_library_size = B_library.size();
+    #pragma omp parallel for 
+    for(int y=0;y<Ann_height;y++) { 
+        for(int x=0;x<Ann_width;x++) { 
+                if (!IS_ACTIVE(active_mask,y,x)) {
+                    Ann(y,x,Y_COORD)=0; 
+                    Ann(y,x,X_COORD)=0; 
+                    Ann(y,x,D_COORD)=0; 
+                    Ann(y,x,I_COORD)=0; 
+                    continue;
+                }
+                for(int attempt=0; attempt<num_random_init_attempts*B_library_size; attempt++) {
+                    int bi = MOD(attempt, B_library_size); 
+                    const Array<byte> &B = *B_library[bi];
+                    int by = RAND_INT(0, B.height()-patch_dim); 
+                    int bx = RAND_INT(0, B.width()-patch_dim); 
+                    int patch_distance = patch_SSD(A, B, x, y, bx, by, patch_dim); 
+                    if (attempt == 0 || patch_distance < Ann(y,x,D_COORD)) {
+                        Ann(y,x,Y_COORD)=by; 
+                        Ann(y,x,X_COORD)=bx; 
+                        Ann(y,x,D_COORD)=patch_distance; 
+                        Ann(y,x,I_COORD)=bi; 
+                    }
+                }
+        } 
+    } 
+}
+
+void calculate_patch_distance_totals(
+            const Array<int> &Ann, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            long &total_patch_distance, 
+            double &mean_patch_distance
+        ) {
+    total_patch_distance = 0;
+    #pragma omp parallel for reduction(+:total_patch_distance)
+    for(int y=0; y<Ann_height; y++) { 
+        for(int x=0; x<Ann_width; x++) { 
+            total_patch_distance += LONG(Ann(y,x,D_COORD));
+        }
+    }
+    mean_patch_distance = DOUBLE(total_patch_distance)/DOUBLE(Ann_height*Ann_width);
+}
+
+struct candidate_cache {
+    // Per pixel ring buffer of fingerprints of the most recently tested candidates. 0 marks an empty slot. 
+    int size;
+    Array<unsigned short> fingerprints;
+    Array<byte> next_slot;
+};
+
+void init_candidate_cache(candidate_cache &cache, const int &Ann_height, const int &Ann_width, const int &size) {
+    ASSERT(0 <= size && size <= 255, "candidate_cache_size must be in the range [0,255]");
+    cache.size = size;
+    if (size == 0) {
+        return;
+    }
+    cache.fingerprints.resize(vector<int>{Ann_height, Ann_width, size});
+    cache.next_slot.resize(vector<int>{Ann_height, Ann_width});
+    cache.fingerprints.clear(0);
+    cache.next_slot.clear(0);
+}
+
+bool candidate_already_tested(
+            const Array<int> &Ann, 
+            candidate_cache &cache, 
+            const int &ax, 
+            const int &ay, 
+            const int &bi, 
+            const int &bx, 
+            const int &by, 
+            const int &B_offset, 
+            const int &B_width
+        ) {
+    // A candidate identical to the current match or to one of the last <cache.size> candidates tested at (ax,ay) cannot improve the match, since D_COORD only ever decreases, so its SSD need not be computed. 
+    // Candidates are remembered by a 16 bit fingerprint rather than in full to keep the cache small. Two candidates share a fingerprint with probability 1/65535, in which case the second is skipped even though it was never tested. 
+    if (bx == Ann(ay,ax,X_COORD) && by == Ann(ay,ax,Y_COORD) && bi == Ann(ay,ax,I_COORD)) {
+        return true;
+    }
+    if (cache.size <= 0) {
+        return false;
+    }
+    const unsigned int candidate = B_offset+by*B_width+bx; // B_offset is the number of pixels in the B library images before image bi
+    const unsigned short fingerprint = 1+((candidate*2654435761U)>>16)%65535;
+    for(int i=0; i<cache.size; i++) {
+        if (cache.fingerprints(ay,ax,i) == fingerprint) {
+            return true;
+        }
+    }
+    byte &next_slot = cache.next_slot(ay,ax);
+    cache.fingerprints(ay,ax,next_slot) = fingerprint;
+    next_slot = (next_slot+1 == cache.size) ? 0 : next_slot+1;
+    return false;
+}
+
+int default_num_per_image_iterations(const int &B_library_size, const int &num_iterations) {
+    // With more than one B image, the first iteration solves each image on its own (see patchmatch())
+    if (B_library_size == 1) {
+        return 0;
+    }
+    return MIN(1, num_iterations);
+}
+
 void patchmatch(
             const Array<byte> &A, 
-            const Array<byte> &B, 
+            const vector<const Array<byte>*> &B_library, 
             Array<int> &Ann, 
             const int &A_height, 
             const int &A_width, 
-            const int &B_height, 
-            const int &B_width, 
             const int &Ann_height, 
             const int &Ann_width, 
             const int &patch_dim, 
             const int &num_iterations, 
             const int &random_search_size_exponent, 
             const int &num_random_search_attempts, 
+            const int &candidate_cache_size, 
             long &total_patch_distance, 
-            double &mean_patch_distance
+            double &mean_patch_distance, 
+            long &num_patch_SSD_evaluations, 
+            long &num_patch_SSD_evaluations_skipped, 
+            const bool &start_going_down_and_right=true, 
+            const Array<byte> *active_mask=NULL, 
+            const int &num_per_image_iterations=-1, 
+            const int &num_random_init_attempts=1, 
+            candidate_cache *tested_candidates=NULL
         ) {
     
-    bool going_down_and_right = true; 
+    const int B_library_size = B_library.size();
+    vector<int> B_offsets(B_library_size);
+    long B_library_num_pixels = 0;
+    for(int bi=0; bi<B_library_size; bi++) {
+        B_offsets[bi] = INT(B_library_num_pixels);
+        B_library_num_pixels += LONG(B_library[bi]->height())*LONG(B_library[bi]->width());
+    }
+    ASSERT(B_library_num_pixels <= 2147483647L, "The B library must have fewer than 2^31 pixels in total");
+    
+    // Callers that run patchmatch() several times on the same field pass their own cache of tested candidates so that it is kept across calls
+    candidate_cache local_tested_candidates;
+    if (tested_candidates == NULL) {
+        init_candidate_cache(local_tested_candidates, Ann_height, Ann_width, candidate_cache_size);
+    }
+    candidate_cache &cache = (tested_candidates == NULL) ? local_tested_candidates : *tested_candidates;
+    ASSERT(cache.size == candidate_cache_size, "The candidate cache must hold candidate_cache_size candidates per patch");
+    
+    num_patch_SSD_evaluations = 0;
+    num_patch_SSD_evaluations_skipped = 0;
+    
+    bool going_down_and_right = start_going_down_and_right; 
+    int num_library_iterations = num_iterations;
+    
+    // With more than one B image, the first num_per_image_iterations (by default one, see default_num_per_image_iterations()) solve each image of the library on its own and the results are merged per patch. 
+    // A joint iteration only propagates and searches around each patch's current match, so a coherent region in an image that loses the random initialization at a few patches grows slowly; one iteration per image lets each image build its regions before they compete. 
+    // The remaining iterations search the whole library. Each per image solve starts from the best of num_random_init_attempts random patches in that image, or from the current match if it is in that image and better. 
+    if (B_library_size > 1) {
+        const int num_library_per_image_iterations = (num_per_image_iterations >= 0) ? MIN(num_per_image_iterations,num_iterations) : default_num_per_image_iterations(B_library_size, num_iterations);
+        for(int bi=0; bi<B_library_size && num_library_per_image_iterations>0; bi++) {
+            const vector<const Array<byte>*> B_single(1, B_library[bi]);
+            Array<int> Inn(vector<int>{Ann_height, Ann_width, NNF_CHANNELS});
+            long image_total_patch_distance, image_num_patch_SSD_evaluations, image_num_patch_SSD_evaluations_skipped;
+            double image_mean_patch_distance;
+            randomize_nnf(A, B_single, Inn, Ann_height, Ann_width, patch_dim, active_mask, num_random_init_attempts);
+            #pragma omp parallel for
+            for(int y=0; y<Ann_height; y++) {
+                for(int x=0; x<Ann_width; x++) {
+                    if (IS_ACTIVE(active_mask,y,x) && Ann(y,x,I_COORD) == bi && Ann(y,x,D_COORD) < Inn(y,x,D_COORD)) {
+                        Inn(y,x,Y_COORD) = Ann(y,x,Y_COORD);
+                        Inn(y,x,X_COORD) = Ann(y,x,X_COORD);
+                        Inn(y,x,D_COORD) = Ann(y,x,D_COORD);
+                    }
+                }
+            }
+            patchmatch(A, B_single, Inn, A_height, A_width, Ann_height, Ann_width, patch_dim, num_library_per_image_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, image_total_patch_distance, image_mean_patch_distance, image_num_patch_SSD_evaluations, image_num_patch_SSD_evaluations_skipped, start_going_down_and_right, active_mask);
+            num_patch_SSD_evaluations += image_num_patch_SSD_evaluations;
+            num_patch_SSD_evaluations_skipped += image_num_patch_SSD_evaluations_skipped;
+            #pragma omp parallel for
+            for(int y=0; y<Ann_height; y++) {
+                for(int x=0; x<Ann_width; x++) {
+                    if (IS_SEARCHED(active_mask,y,x) && Inn(y,x,D_COORD) < Ann(y,x,D_COORD)) {
+                        Ann(y,x,Y_COORD) = Inn(y,x,Y_COORD);
+                        Ann(y,x,X_COORD) = Inn(y,x,X_COORD);
+                        Ann(y,x,D_COORD) = Inn(y,x,D_COORD);
+                        Ann(y,x,I_COORD) = bi;
+                    }
+                }
+            }
+        }
+        num_library_iterations = num_iterations-num_library_per_image_iterations;
+        going_down_and_right = IS_EVEN(num_library_per_image_iterations) ? start_going_down_and_right : !start_going_down_and_right;
+    }
     
-    for(int iteration_index=0; iteration_index<num_iterations; iteration_index++) { 
+    for(int iteration_index=0; iteration_index<num_library_iterations; iteration_index++) { 
         int delta, start_x, start_y; 
         if (going_down_and_right) { 
             delta = 1; 
@@ -66,44 +255,64 @@ void patchmatch(
             start_y = 0; 
         } else { 
             delta = -1; 
-            start_x = Ann_height-1; 
+            start_x = Ann_width-1; 
             start_y = Ann_height-1; 
         }
         
         // Belief Propogation 
         for(int y=start_y; 0<=y && y<Ann_height; y+=delta) { 
             for(int x=start_x; 0<=x && x<Ann_width; x+=delta) { 
+                if (!IS_SEARCHED(active_mask,y,x)) {
+                    continue;
+                }
+                int bi;
                 int by;
                 int bx;
                 // Vertical offset
-                if (0<=y-delta && y-delta<Ann_height) {
+                if (0<=y-delta && y-delta<Ann_height && IS_ACTIVE(active_mask,y-delta,x)) {
+                    bi = Ann(y-delta,x,I_COORD); 
                     by = Ann(y-delta,x,Y_COORD)+delta; 
                     bx = Ann(y-delta,x,X_COORD); 
-                    if  (0<=by && by<B_height-patch_dim+1) {
+                    const Array<byte> &B = *B_library[bi];
+                    if  (0<=by && by<B.height()-patch_dim+1) {
                         int ay = y; 
                         int ax = x; 
-                        int old_patch_distance = Ann(y,x,D_COORD);
-                        int new_patch_distance = patch_SSD(A, B, ax, ay, bx, by, patch_dim);
-                        if (new_patch_distance<old_patch_distance) {
-                            Ann(y,x,Y_COORD) = by;
-                            Ann(y,x,X_COORD) = bx;
-                            Ann(y,x,D_COORD) = new_patch_distance;
+                        if (candidate_already_tested(Ann, cache, ax, ay, bi, bx, by, B_offsets[bi], B.width())) {
+                            num_patch_SSD_evaluations_skipped++;
+                        } else {
+                            num_patch_SSD_evaluations++;
+                            int old_patch_distance = Ann(y,x,D_COORD);
+                            int new_patch_distance = patch_SSD(A, B, ax, ay, bx, by, patch_dim);
+                            if (new_patch_distance<old_patch_distance) {
+                                Ann(y,x,Y_COORD) = by;
+                                Ann(y,x,X_COORD) = bx;
+                                Ann(y,x,D_COORD) = new_patch_distance;
+                                Ann(y,x,I_COORD) = bi;
+                            }
                         }
                     }
                 } 
                 // Horizontal offset
-                if (0<=x-delta && x-delta<Ann_width) {
-                    by = Ann(y,x,Y_COORD); 
+                if (0<=x-delta && x-delta<Ann_width && IS_ACTIVE(active_mask,y,x-delta)) {
+                    bi = Ann(y,x-delta,I_COORD); 
+                    by = Ann(y,x-delta,Y_COORD); 
                     bx = Ann(y,x-delta,X_COORD)+delta; 
-                    if (0<=bx && bx<B_width-patch_dim+1) {
+                    const Array<byte> &B = *B_library[bi];
+                    if (0<=bx && bx<B.width()-patch_dim+1) {
                         int ay = y; 
                         int ax = x; 
-                        int old_patch_distance = Ann(y,x,D_COORD);
-                        int new_patch_distance = patch_SSD(A, B, ax, ay, bx, by, patch_dim);
-                        if (new_patch_distance<old_patch_distance) {
-                            Ann(y,x,Y_COORD) = by;
-                            Ann(y,x,X_COORD) = bx;
-                            Ann(y,x,D_COORD) = new_patch_distance;
+                        if (candidate_already_tested(Ann, cache, ax, ay, bi, bx, by, B_offsets[bi], B.width())) {
+                            num_patch_SSD_evaluations_skipped++;
+                        } else {
+                            num_patch_SSD_evaluations++;
+                            int old_patch_distance = Ann(y,x,D_COORD);
+                            int new_patch_distance = patch_SSD(A, B, ax, ay, bx, by, patch_dim);
+                            if (new_patch_distance<old_patch_distance) {
+                                Ann(y,x,Y_COORD) = by;
+                                Ann(y,x,X_COORD) = bx;
+                                Ann(y,x,D_COORD) = new_patch_distance;
+                                Ann(y,x,I_COORD) = bi;
+                            }
                         }
                     }
                 } 
@@ -115,8 +324,15 @@ void patchmatch(
         // Random Search
         for(int y=0;y<Ann_height;y++) { 
             for(int x=0;x<Ann_width;x++) { 
+                if (!IS_SEARCHED(active_mask,y,x)) {
+                    continue;
+                }
+                int bi = Ann(y,x,I_COORD);
                 int bx = Ann(y,x,X_COORD);
                 int by = Ann(y,x,Y_COORD);
+                const Array<byte> &B = *B_library[bi];
+                const int B_height = B.height();
+                const int B_width = B.width();
                 for(int radius_index=random_search_size_exponent; 0<radius_index; radius_index--) {
                     int radius = INT(pow(2,radius_index));
                     int search_box_min_x = MAX(0,bx-radius);
@@ -126,27 +342,253 @@ void patchmatch(
                     for(int search_attempt_count=0; search_attempt_count<num_random_search_attempts; search_attempt_count++) {
                         int bx_new = RAND_INT(search_box_min_x,search_box_max_x);
                         int by_new = RAND_INT(search_box_min_y,search_box_max_y);
+                        if (candidate_already_tested(Ann, cache, x, y, bi, bx_new, by_new, B_offsets[bi], B_width)) {
+                            num_patch_SSD_evaluations_skipped++;
+                            continue;
+                        }
+                        num_patch_SSD_evaluations++;
                         int old_patch_distance = Ann(y,x,D_COORD);
                         int new_patch_distance = patch_SSD(A, B, x, y, bx_new, by_new, patch_dim);
                         if (new_patch_distance<old_patch_distance) {
                             Ann(y,x,Y_COORD) = by_new;
                             Ann(y,x,X_COORD) = bx_new;
                             Ann(y,x,D_COORD) = new_patch_distance;
+                            Ann(y,x,I_COORD) = bi;
                         }
                     }
                 }
+                // With more than one B image, also try a patch anywhere in a random image of the library so that matches can move between images
+                if (B_library_size > 1) {
+                    int bi_new = RAND_INT(0,B_library_size);
+                    const Array<byte> &B_new = *B_library[bi_new];
+                    int bx_new = RAND_INT(0,B_new.width()-patch_dim);
+                    int by_new = RAND_INT(0,B_new.height()-patch_dim);
+                    if (candidate_already_tested(Ann, cache, x, y, bi_new, bx_new, by_new, B_offsets[bi_new], B_new.width())) {
+                        num_patch_SSD_evaluations_skipped++;
+                    } else {
+                        num_patch_SSD_evaluations++;
+                        int new_patch_distance = patch_SSD(A, B_new, x, y, bx_new, by_new, patch_dim);
+                        if (new_patch_distance<Ann(y,x,D_COORD)) {
+                            Ann(y,x,Y_COORD) = by_new;
+                            Ann(y,x,X_COORD) = bx_new;
+                            Ann(y,x,D_COORD) = new_patch_distance;
+                            Ann(y,x,I_COORD) = bi_new;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    calculate_patch_distance_totals(Ann, Ann_height, Ann_width, total_patch_distance, mean_patch_distance);
+}
+
+void seed_nnf_from_inverse(
+            Array<int> &Ann, 
+            const Array<int> &Bnn, 
+            const int &Bnn_height, 
+            const int &Bnn_width
+        ) {
+    // Bnn maps patches in B to patches in A. If B patch (bx,by) matches A patch (ax,ay), then (bx,by) is proposed as a candidate match for (ax,ay) in Ann. 
+    // Both fields must have been computed against single image libraries. 
+    // Several B patches may propose to the same A patch, so this is done serially. 
+    for(int by=0; by<Bnn_height; by++) { 
+        for(int bx=0; bx<Bnn_width; bx++) { 
+            int ay = Bnn(by,bx,Y_COORD);
+            int ax = Bnn(by,bx,X_COORD);
+            if (by == Ann(ay,ax,Y_COORD) && bx == Ann(ay,ax,X_COORD)) {
+                continue;
+            }
+            int new_patch_distance = Bnn(by,bx,D_COORD); // SSD is symmetric, so the distance computed for Bnn can be reused
+            if (new_patch_distance<Ann(ay,ax,D_COORD)) {
+                Ann(ay,ax,Y_COORD) = by;
+                Ann(ay,ax,X_COORD) = bx;
+                Ann(ay,ax,D_COORD) = new_patch_distance;
+                Ann(ay,ax,I_COORD) = 0;
+            }
+        }
+    }
+}
+
+void patchmatch_query_group(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            const Array<int> &queries, 
+            const vector<int> &query_indices, 
+            Array<int> &Qnn, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &patch_dim, 
+            const int &query_window_radius, 
+            const int &num_random_init_attempts, 
+            const int &num_iterations, 
+            const int &random_search_size_exponent, 
+            const int &num_random_search_attempts, 
+            const int &candidate_cache_size, 
+            long &num_patch_SSD_evaluations, 
+            long &num_patch_SSD_evaluations_skipped
+        ) {
+    // PatchMatch is run once on the union of the windows of patches within query_window_radius of the queries listed in query_indices, and only the results for the query patches are written to Qnn. 
+    // Only the bounding box W of the union is allocated, and only patches inside the union are initialized and searched. 
+    const int channels = A.channels();
+    const int num_group_queries = query_indices.size();
+    int window_min_y = A_height, window_min_x = A_width, window_max_y = 0, window_max_x = 0;
+    for(int i=0; i<num_group_queries; i++) {
+        const int query_index = query_indices[i];
+        window_min_y = MIN(window_min_y,MAX(0,queries(query_index,Y_COORD)-query_window_radius));
+        window_min_x = MIN(window_min_x,MAX(0,queries(query_index,X_COORD)-query_window_radius));
+        window_max_y = MAX(window_max_y,MIN(A_height-patch_dim+1,queries(query_index,Y_COORD)+query_window_radius+1));
+        window_max_x = MAX(window_max_x,MIN(A_width-patch_dim+1,queries(query_index,X_COORD)+query_window_radius+1));
+    }
+    const int Wnn_height = window_max_y-window_min_y;
+    const int Wnn_width = window_max_x-window_min_x;
+    const int W_height = Wnn_height+patch_dim-1;
+    const int W_width = Wnn_width+patch_dim-1;
+    
+    Array<byte> active_mask(vector<int>{Wnn_height, Wnn_width});
+    active_mask.clear(0);
+    for(int i=0; i<num_group_queries; i++) {
+        const int qy = queries(query_indices[i],Y_COORD)-window_min_y;
+        const int qx = queries(query_indices[i],X_COORD)-window_min_x;
+        for(int y=MAX(0,qy-query_window_radius); y<MIN(Wnn_height,qy+query_window_radius+1); y++) {
+            for(int x=MAX(0,qx-query_window_radius); x<MIN(Wnn_width,qx+query_window_radius+1); x++) {
+                active_mask(y,x) = ACTIVE_PATCH;
             }
         }
     }
     
+    Array<byte> W(vector<int>{W_height, W_width, channels});
+    #pragma omp parallel for
+    for(int y=0; y<W_height; y++) {
+        for(int x=0; x<W_width; x++) {
+            for(int z=0; z<channels; z++) {
+                W(y,x,z) = A(window_min_y+y,window_min_x+x,z);
+            }
+        }
+    }
+    
+    Array<int> Wnn(vector<int>{Wnn_height, Wnn_width, NNF_CHANNELS});
+    long window_total_patch_distance;
+    double window_mean_patch_distance;
+    randomize_nnf(W, B_library, Wnn, Wnn_height, Wnn_width, patch_dim, &active_mask, num_random_init_attempts);
+    patchmatch(W, B_library, Wnn, W_height, W_width, Wnn_height, Wnn_width, patch_dim, num_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, window_total_patch_distance, window_mean_patch_distance, num_patch_SSD_evaluations, num_patch_SSD_evaluations_skipped, true, &active_mask, -1, num_random_init_attempts);
+    
+    for(int i=0; i<num_group_queries; i++) {
+        const int query_index = query_indices[i];
+        for(int coord=0; coord<NNF_CHANNELS; coord++) {
+            Qnn(query_index,coord) = Wnn(queries(query_index,Y_COORD)-window_min_y,queries(query_index,X_COORD)-window_min_x,coord);
+        }
+    }
+}
+
+void patchmatch_sparse(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            const Array<int> &queries, 
+            Array<int> &Qnn, 
+            const int &num_queries, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &patch_dim, 
+            const int &query_window_radius, 
+            const int &num_random_init_attempts, 
+            const int &num_iterations, 
+            const int &random_search_size_exponent, 
+            const int &num_random_search_attempts, 
+            const int &candidate_cache_size, 
+            long &total_patch_distance, 
+            double &mean_patch_distance, 
+            long &num_patch_SSD_evaluations, 
+            long &num_patch_SSD_evaluations_skipped
+        ) {
+    // queries holds the (Y_COORD,X_COORD) of the upper left corners of the query patches in A. 
+    // The queries are grouped by square tiles of A four windows wide, and each group is solved once on the union of its windows (see patchmatch_query_group()), so that nearby queries share propagation. 
+    // A group's bounding box never extends more than query_window_radius past its tile, so the allocated area and the run time scale with the number of tiles holding queries rather than with the area of A, however far apart the queries are. 
+    // The windows are much smaller than A, so each patch keeps the best of num_random_init_attempts random initial matches to make up for having fewer neighbors to propagate from. 
+    Qnn.resize(vector<int>{num_queries, NNF_CHANNELS});
+    num_patch_SSD_evaluations = 0;
+    num_patch_SSD_evaluations_skipped = 0;
     total_patch_distance = 0;
-    // Calculate total and mean patch distances
-    for(int y=0; y<Ann_height; y++) { 
-        for(int x=0; x<Ann_width; x++) { 
-            total_patch_distance += LONG(Ann(y,x,D_COORD));
+    mean_patch_distance = 0;
+    if (num_queries == 0) {
+        return;
+    }
+    
+    const int tile_size = 4*(2*query_window_radius+1);
+    const int num_tile_rows = (A_height-patch_dim+1+tile_size-1)/tile_size;
+    const int num_tile_columns = (A_width-patch_dim+1+tile_size-1)/tile_size;
+    vector< vector<int> > tile_query_indices(num_tile_rows*num_tile_columns);
+    for(int query_index=0; query_index<num_queries; query_index++) {
+        tile_query_indices[(queries(query_index,Y_COORD)/tile_size)*num_tile_columns+queries(query_index,X_COORD)/tile_size].push_back(query_index);
+    }
+    
+    for(int tile=0; tile<tile_query_indices.size(); tile++) {
+        if (tile_query_indices[tile].size() == 0) {
+            continue;
+        }
+        long group_num_patch_SSD_evaluations, group_num_patch_SSD_evaluations_skipped;
+        patchmatch_query_group(A, B_library, queries, tile_query_indices[tile], Qnn, A_height, A_width, patch_dim, query_window_radius, num_random_init_attempts, num_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, group_num_patch_SSD_evaluations, group_num_patch_SSD_evaluations_skipped);
+        num_patch_SSD_evaluations += group_num_patch_SSD_evaluations;
+        num_patch_SSD_evaluations_skipped += group_num_patch_SSD_evaluations_skipped;
+    }
+    
+    for(int query_index=0; query_index<num_queries; query_index++) {
+        total_patch_distance += LONG(Qnn(query_index,D_COORD));
+    }
+    mean_patch_distance = DOUBLE(total_patch_distance)/DOUBLE(num_queries);
+}
+
+void reconstruct_from_nnf(
+            const vector<const Array<byte>*> &B_library, 
+            const Array<int> &Ann, 
+            Array<byte> &reconstruction, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            const bool &distance_weighted, 
+            const double &mean_patch_distance
+        ) {
+    // Each pixel of the reconstruction is the (possibly weighted) average of the pixels of the matched B patches of every A patch covering it. 
+    // This is a gather over the patches covering each output pixel, so every output pixel is written by exactly one thread. 
+    // When distance weighted, a patch with distance d gets weight exp(-d/(2*mean_patch_distance)). 
+    const int channels = B_library[0]->channels();
+    reconstruction.resize(vector<int>{A_height, A_width, channels});
+    const double weight_denominator = 2*MAX(1.0,mean_patch_distance);
+    #pragma omp parallel for
+    for(int y=0; y<A_height; y++) { 
+        vector<double> channel_sums(channels);
+        for(int x=0; x<A_width; x++) { 
+            double total_weight = 0;
+            for(int z=0; z<channels; z++) {
+                channel_sums[z] = 0;
+            }
+            for(int dy=0; dy<patch_dim; dy++) {
+                const int ay = y-dy;
+                if (ay<0 || ay>=Ann_height) {
+                    continue;
+                }
+                for(int dx=0; dx<patch_dim; dx++) {
+                    const int ax = x-dx;
+                    if (ax<0 || ax>=Ann_width) {
+                        continue;
+                    }
+                    const double weight = distance_weighted ? exp(-DOUBLE(Ann(ay,ax,D_COORD))/weight_denominator) : 1.0;
+                    const Array<byte> &B = *B_library[Ann(ay,ax,I_COORD)];
+                    const int by = Ann(ay,ax,Y_COORD)+dy;
+                    const int bx = Ann(ay,ax,X_COORD)+dx;
+                    for(int z=0; z<channels; z++) {
+                        channel_sums[z] += weight*B(by,bx,z);
+                    }
+                    total_weight += weight;
+                }
+            }
+            for(int z=0; z<channels; z++) {
+                reconstruction(y,x,z) = (total_weight > 0) ? BYTE(CLAMP_INT(INT(round(channel_sums[z]/total_weight)))) : 0;
+            }
         }
     }
-    mean_patch_distance = DOUBLE(total_patch_distance)/DOUBLE(Ann_height*Ann_width);
 }
 
 #endif // PATCHMATCH_H
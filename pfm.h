@@ -33,5 +33,16 @@ void write_pfm_file3(const char *filename, float *depth, int w, int h) {
     fclose(f);
 }
 
+void write_pfm_file1(const char *filename, float *depth, int w, int h) {
+    FILE *f = fopen(filename, "wb");
+    double scale = is_little_endian() ? -1.0 : 1.0;
+    fprintf(f, "Pf\n%d %d\n%lf\n", w, h, scale);
+    for (int i = 0; i < w*h; i++) {
+        float d = depth[i];
+        fwrite((void *) &d, 1, 4, f);
+    }
+    fclose(f);
+}
+
 #endif // PFM_H
 
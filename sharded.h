@@ -0,0 +1,233 @@
+
+/*
+
+This is a multi-process version of PatchMatch for Linux. The nearest neighbor field is split into horizontal stripes, each solved by its own worker process. See patchmatch.h for the PatchMatch implementation itself. 
+
+*/
+
+#pragma once
+
+#ifndef SHARDED_H
+#define SHARDED_H
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <omp.h>
+#include "util.h"
+#include "array.h"
+#include "patchmatch.h"
+
+void write_all(const int &fd, const void* buffer, const size_t &num_bytes) {
+    size_t num_bytes_written = 0;
+    while (num_bytes_written < num_bytes) {
+        ssize_t n = write(fd, (const char*)buffer+num_bytes_written, num_bytes-num_bytes_written);
+        if (n <= 0) {
+            fprintf(stderr, "Unable to send halo rows to neighboring worker\n");
+            _exit(1);
+        }
+        num_bytes_written += n;
+    }
+}
+
+void read_all(const int &fd, void* buffer, const size_t &num_bytes) {
+    size_t num_bytes_read = 0;
+    while (num_bytes_read < num_bytes) {
+        ssize_t n = read(fd, (char*)buffer+num_bytes_read, num_bytes-num_bytes_read);
+        if (n <= 0) {
+            fprintf(stderr, "Unable to receive halo rows from neighboring worker\n");
+            _exit(1);
+        }
+        num_bytes_read += n;
+    }
+}
+
+void send_halo_rows(const Array<int> &Lnn, const int &Lnn_height, const size_t &row_num_bytes, const int &socket_above, const int &socket_below) {
+    if (socket_above >= 0) {
+        write_all(socket_above, &Lnn(1,0,0), row_num_bytes);
+    }
+    if (socket_below >= 0) {
+        write_all(socket_below, &Lnn(Lnn_height-2,0,0), row_num_bytes);
+    }
+}
+
+void receive_halo_rows(Array<int> &Lnn, const int &Lnn_height, const size_t &row_num_bytes, const int &socket_above, const int &socket_below) {
+    if (socket_above >= 0) {
+        read_all(socket_above, &Lnn(0,0,0), row_num_bytes);
+    }
+    if (socket_below >= 0) {
+        read_all(socket_below, &Lnn(Lnn_height-1,0,0), row_num_bytes);
+    }
+}
+
+void exchange_halo_rows(Array<int> &Lnn, const int &Lnn_height, const int &Ann_width, const int &shard, const int &socket_above, const int &socket_below) {
+    // Row 0 of Lnn is the halo row owned by the worker above (if any) and row Lnn_height-1 is the halo row owned by the worker below (if any). 
+    // A row may not fit in the socket buffer, so writes block until the neighbor reads. Even workers send then receive and odd workers receive then send, so every blocked write has a reader. 
+    const size_t row_num_bytes = Ann_width*NNF_CHANNELS*sizeof(int);
+    if (IS_EVEN(shard)) {
+        send_halo_rows(Lnn, Lnn_height, row_num_bytes, socket_above, socket_below);
+        receive_halo_rows(Lnn, Lnn_height, row_num_bytes, socket_above, socket_below);
+    } else {
+        receive_halo_rows(Lnn, Lnn_height, row_num_bytes, socket_above, socket_below);
+        send_halo_rows(Lnn, Lnn_height, row_num_bytes, socket_above, socket_below);
+    }
+}
+
+void patchmatch_sharded(
+            const Array<byte> &A, 
+            const vector<const Array<byte>*> &B_library, 
+            Array<int> &Ann, 
+            const int &A_height, 
+            const int &A_width, 
+            const int &Ann_height, 
+            const int &Ann_width, 
+            const int &patch_dim, 
+            const int &num_shards, 
+            const int &num_iterations, 
+            const int &random_search_size_exponent, 
+            const int &num_random_search_attempts, 
+            const int &candidate_cache_size, 
+            long &total_patch_distance, 
+            double &mean_patch_distance, 
+            long &num_patch_SSD_evaluations, 
+            long &num_patch_SSD_evaluations_skipped
+        ) {
+    // Ann must already be initialized (e.g. by randomize_nnf()). Each worker is forked from this process, so A, the B library and the initial Ann are shared read-only (copy on write) rather than copied. 
+    // A worker solves its stripe of Ann and also keeps one halo row above and below owned by its neighbors. After every iteration, workers send their first and last rows to their neighbors over local sockets so that propagation crosses stripe borders. 
+    // The solved stripes and counters are written back through shared anonymous memory. 
+    ASSERT(1 <= num_shards && num_shards <= Ann_height, "num_shards must be in the range [1,Ann_height]");
+    
+    const size_t shared_nnf_num_bytes = LONG(Ann_height)*LONG(Ann_width)*NNF_CHANNELS*sizeof(int);
+    const size_t shared_counters_num_bytes = 2*num_shards*sizeof(long);
+    int* shared_nnf = (int*)mmap(NULL, shared_nnf_num_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    long* shared_counters = (long*)mmap(NULL, shared_counters_num_bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (shared_nnf == MAP_FAILED || shared_counters == MAP_FAILED) {
+        fprintf(stderr, "Unable to allocate shared memory for %d workers\n", num_shards);
+        exit(1);
+    }
+    
+    // Worker i talks to worker i+1 over boundary_sockets[i]
+    vector<int> boundary_sockets(2*(num_shards-1));
+    for(int boundary=0; boundary<num_shards-1; boundary++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &boundary_sockets[2*boundary]) != 0) {
+            fprintf(stderr, "Unable to create sockets between workers %d and %d\n", boundary, boundary+1);
+            exit(1);
+        }
+    }
+    
+    fflush(stdout);
+    vector<pid_t> worker_pids(num_shards);
+    for(int shard=0; shard<num_shards; shard++) {
+        worker_pids[shard] = fork();
+        if (worker_pids[shard] < 0) {
+            fprintf(stderr, "Unable to start worker %d\n", shard);
+            exit(1);
+        }
+        if (worker_pids[shard] > 0) {
+            continue;
+        }
+        
+        // Worker process 
+        omp_set_num_threads(1);
+        std::srand( std::time(NULL)^(getpid()<<16) );
+        const int socket_above = (shard > 0) ? boundary_sockets[2*(shard-1)+1] : -1;
+        const int socket_below = (shard < num_shards-1) ? boundary_sockets[2*shard] : -1;
+        for(int i=0; i<boundary_sockets.size(); i++) {
+            if (boundary_sockets[i] != socket_above && boundary_sockets[i] != socket_below) {
+                close(boundary_sockets[i]);
+            }
+        }
+        
+        const int own_min_y = LONG(shard)*Ann_height/num_shards;
+        const int own_max_y = LONG(shard+1)*Ann_height/num_shards;
+        const int local_min_y = own_min_y-(socket_above >= 0);
+        const int local_max_y = own_max_y+(socket_below >= 0);
+        const int Lnn_height = local_max_y-local_min_y;
+        const int L_height = Lnn_height+patch_dim-1;
+        const int channels = A.channels();
+        
+        Array<byte> L(vector<int>{L_height, A_width, channels});
+        for(int y=0; y<L_height; y++) {
+            for(int x=0; x<A_width; x++) {
+                for(int z=0; z<channels; z++) {
+                    L(y,x,z) = A(local_min_y+y,x,z);
+                }
+            }
+        }
+        Array<int> Lnn(vector<int>{Lnn_height, Ann_width, NNF_CHANNELS});
+        for(int y=0; y<Lnn_height; y++) {
+            for(int x=0; x<Ann_width; x++) {
+                for(int coord=0; coord<NNF_CHANNELS; coord++) {
+                    Lnn(y,x,coord) = Ann(local_min_y+y,x,coord);
+                }
+            }
+        }
+        
+        // The halo rows are only propagated from, never searched, since the neighbor that owns them overwrites them after every iteration. So only owned rows are counted. 
+        Array<byte> halo_mask(vector<int>{Lnn_height, Ann_width});
+        halo_mask.clear(ACTIVE_PATCH);
+        for(int x=0; x<Ann_width; x++) {
+            if (socket_above >= 0) {
+                halo_mask(0,x) = FIXED_PATCH;
+            }
+            if (socket_below >= 0) {
+                halo_mask(Lnn_height-1,x) = FIXED_PATCH;
+            }
+        }
+        candidate_cache tested_candidates;
+        init_candidate_cache(tested_candidates, Lnn_height, Ann_width, candidate_cache_size);
+        
+        // With a library, the per image iterations (see patchmatch()) run in one call over the whole stripe, and halo rows are exchanged after it and after every joint iteration but the last
+        const int num_per_image_iterations = default_num_per_image_iterations(B_library.size(), num_iterations);
+        long worker_num_patch_SSD_evaluations = 0;
+        long worker_num_patch_SSD_evaluations_skipped = 0;
+        int num_call_iterations;
+        for(int iteration_index=0; iteration_index<num_iterations; iteration_index+=num_call_iterations) {
+            num_call_iterations = (iteration_index == 0 && num_per_image_iterations > 0) ? num_per_image_iterations : 1;
+            long iteration_total_patch_distance, iteration_num_patch_SSD_evaluations, iteration_num_patch_SSD_evaluations_skipped;
+            double iteration_mean_patch_distance;
+            patchmatch(L, B_library, Lnn, L_height, A_width, Lnn_height, Ann_width, patch_dim, num_call_iterations, random_search_size_exponent, num_random_search_attempts, candidate_cache_size, iteration_total_patch_distance, iteration_mean_patch_distance, iteration_num_patch_SSD_evaluations, iteration_num_patch_SSD_evaluations_skipped, IS_EVEN(iteration_index), &halo_mask, (iteration_index == 0) ? num_per_image_iterations : 0, 1, &tested_candidates);
+            worker_num_patch_SSD_evaluations += iteration_num_patch_SSD_evaluations;
+            worker_num_patch_SSD_evaluations_skipped += iteration_num_patch_SSD_evaluations_skipped;
+            if (iteration_index+num_call_iterations < num_iterations) {
+                exchange_halo_rows(Lnn, Lnn_height, Ann_width, shard, socket_above, socket_below);
+            }
+        }
+        
+        memcpy(&shared_nnf[LONG(own_min_y)*Ann_width*NNF_CHANNELS], &Lnn(own_min_y-local_min_y,0,0), LONG(own_max_y-own_min_y)*Ann_width*NNF_CHANNELS*sizeof(int));
+        shared_counters[2*shard] = worker_num_patch_SSD_evaluations;
+        shared_counters[2*shard+1] = worker_num_patch_SSD_evaluations_skipped;
+        _exit(0);
+    }
+    
+    for(int i=0; i<boundary_sockets.size(); i++) {
+        close(boundary_sockets[i]);
+    }
+    bool all_workers_succeeded = true;
+    for(int shard=0; shard<num_shards; shard++) {
+        int status;
+        waitpid(worker_pids[shard], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Worker %d failed\n", shard);
+            all_workers_succeeded = false;
+        }
+    }
+    if (!all_workers_succeeded) {
+        exit(1);
+    }
+    
+    memcpy(Ann.data, shared_nnf, shared_nnf_num_bytes);
+    num_patch_SSD_evaluations = 0;
+    num_patch_SSD_evaluations_skipped = 0;
+    for(int shard=0; shard<num_shards; shard++) {
+        num_patch_SSD_evaluations += shared_counters[2*shard];
+        num_patch_SSD_evaluations_skipped += shared_counters[2*shard+1];
+    }
+    munmap(shared_nnf, shared_nnf_num_bytes);
+    munmap(shared_counters, shared_counters_num_bytes);
+    
+    calculate_patch_distance_totals(Ann, Ann_height, Ann_width, total_patch_distance, mean_patch_distance);
+}
+
+#endif // SHARDED_H
@@ -109,7 +109,8 @@ void split(const string &line, const string &delimiter, vector<string> &vector_o
         start = end + delimiter.length();
         end = line.find(delimiter, start);
     }
-    if (delimiter != string("\n")) { // since files have an extra newline at the end, we need to make sure we don't count the extra empty line we may get if our delimiter is the newline
+    // The last element is kept unless it is empty and either skip_empty is set or the delimiter is the newline, since files have an extra newline at the end and we don't want to count the extra empty line. A last line without a newline is still kept. 
+    if (start < line.size() || (!skip_empty && delimiter != string("\n"))) {
         vector_of_strings.push_back( line.substr(start, end) );
     }
 }
@@ -150,5 +151,15 @@ void read_file(const string &filename, string &output) {
     read_file(filename.c_str(), output);
 }
 
+void read_file_or_exit(const char* const &filename, string &output) { 
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for reading\n", filename);
+        exit(1);
+    }
+    fclose(f);
+    read_file(filename, output);
+}
+
 #endif // UTIL_H
 